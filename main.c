@@ -92,12 +92,52 @@ void test_rchosen(char *expected){
     number_of_tests++;
 }
 
+void test_rtrim(char *name, Boolean expected){
+    if(rtrim(name) == expected){
+        printf("rtrim test succeeded.\n");
+    } else {
+        printf("rtrim test failed.\n");
+        failed_tests++;
+    }
+    number_of_tests++;
+}
+
+void test_zeroed(char *ptr, rsize_t size){
+    rsize_t i = 0;
+
+    while(i < size && ptr[i] == 0){
+        i++;
+    }
+    if(i == size){
+        printf("Block of size %d is zeroed.\n", size);
+    } else {
+        printf("Block of size %d is not zeroed.\n", size);
+        failed_tests++;
+    }
+    number_of_tests++;
+}
+
+void test_filled(char *ptr, rsize_t size, char expected){
+    rsize_t i = 0;
+
+    while(i < size && ptr[i] == expected){
+        i++;
+    }
+    if(i == size){
+        printf("Block of size %d kept its contents.\n", size);
+    } else {
+        printf("Block of size %d lost its contents at byte %d.\n", size, i);
+        failed_tests++;
+    }
+    number_of_tests++;
+}
+
 
 int main()
 {
     printf("Processing...\n");
 
-    char *p1, *p2, *p3;
+    char *p1, *p2, *p3, *p4;
 
     test_rinit("first", 600, TRUE);
     test_rinit("second", 999, TRUE);
@@ -157,6 +197,67 @@ int main()
     rdestroy("final");
     rdump(); //nothing
 
+    //returning freed memory to the OS
+    rtrim_config(8*1024, FALSE); //only trim in rtrim()
+    test_rinit("big", 60000, TRUE);
+    p1 = ralloc(4096);
+    p2 = ralloc(40000);
+    p3 = ralloc(100);
+    assert(p1 != NULL && p2 != NULL && p3 != NULL);
+    memset(p1, 'a', 4096);
+    memset(p2, 'b', 40000);
+    memset(p3, 'c', 100);
+    rfree(p2);
+    test_rtrim("big", TRUE);
+    test_rtrim("region that doesn't exist", FALSE);
+    p2 = ralloc(40000); //reuses the trimmed gap
+    test_zeroed(p2, 40000);
+    memset(p2, 'b', 40000);
+    rfree(p1);
+    rfree(p3);
+    p4 = ralloc(1000); //partly lands on memory that wasn't trimmed
+    test_zeroed(p4, 1000);
+    memset(p4, 'd', 1000);
+
+    rtrim_config(8*1024, TRUE); //trim right away in rfree()
+    rfree(p2);
+    p2 = ralloc(30000);
+    test_zeroed(p2, 30000);
+    test_filled(p4, 1000, 'd'); //untouched by the trim in rfree() next to it
+    rdump();
+    rdestroy("big");
+
+    //gap in the last partial page of a region close to the largest size
+    rtrim_config(1, FALSE);
+    test_rinit("edge", 65528, TRUE);
+    p1 = ralloc(61448);
+    assert(p1 != NULL);
+    memset(p1, 'a', 61448);
+    p2 = ralloc(100);
+    assert(p2 != NULL);
+    rfree(p2);
+    test_rtrim("edge", TRUE);
+    test_filled(p1, 61448, 'a');
+
+    //live blocks on both sides of a trimmed gap that doesn't start or end on a page
+    p2 = ralloc(4000);
+    p3 = ralloc(24);
+    assert(p2 != NULL && p3 != NULL);
+    memset(p3, 'c', 24);
+    rfree(p2);
+    rfree(p1);
+    p1 = ralloc(10);
+    assert(p1 != NULL);
+    memset(p1, 'a', 10);
+    test_rtrim("edge", TRUE);
+    test_filled(p1, 10, 'a');
+    test_filled(p3, 24, 'c');
+    p2 = ralloc(61000); //lands partly on trimmed pages, partly on dirty memory
+    assert(p2 != NULL);
+    test_zeroed(p2, 61000);
+    rdump();
+    rdestroy("edge");
+
     printf("\nPrinting test results...\n");
   	printf("Number of tests completed: %d\n", number_of_tests);
   	printf("Number of tests failed: %d\n", failed_tests);
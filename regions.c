@@ -9,6 +9,7 @@
  *
  * PURPOSE: Named Memory regions implementation. This program uses a list of linked list implemented regions which each hold another linked list of Nodes. Nodes hold the position of addresses in the region allocated memory that can be used.
  * The program is able to create and allocate regions, use memory in those regions, remove blocks of memory, and destroy regions.
+ * Large free gaps can be handed back to the OS, and the pages released that way are remembered as zero-filled so ralloc() doesn't have to clear them again.
  */
 
 #include <stdio.h>
@@ -16,12 +17,16 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "regions.h"
 
 #define BYTE_8 8
+#define DEFAULT_TRIM_THRESHOLD (32 * 1024)
 
 typedef struct NODE Node;
+typedef struct SPAN Span;
 typedef struct REGION Region;
 typedef struct REGION_LIST r_List;
 
@@ -32,6 +37,13 @@ struct NODE {
     Node *next;
 };
 
+struct SPAN {
+    rsize_t start; //start of the span in terms of number of bytes into the region's buffer
+    rsize_t size; //size of the span
+    Span *next;
+}; //span of a region's buffer that is known to be zero-filled
+
+
 struct REGION {
     Region *next;
     char *name;
@@ -39,6 +51,11 @@ struct REGION {
     rsize_t size; //size of the region's allocated memory
     Node *top;  
     int length; //the number of blocks of Nodes within this regions (used to test invariants)
+    Span *clean; //sorted list of spans of the buffer that are known to hold only zeroes
+    unsigned long rss_before; //bytes of the buffer resident before the last rtrim() (not measured when rfree() trims, to keep rfree() cheap)
+    unsigned long rss_after; //bytes of the buffer resident after the last rtrim()
+    Boolean trimmed; //whether rss_before and rss_after hold anything yet
+    unsigned long released; //bytes of the buffer returned to the OS so far; memory reused and released again counts again
 }; //REGION struct
 
 struct REGION_LIST {
@@ -51,6 +68,10 @@ struct REGION_LIST {
 static Region *current = NULL;
 static r_List *region_list = NULL;
 
+//trimming policy: free gaps of at least trim_threshold bytes are released, either on rfree() or on rtrim().
+static rsize_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+static Boolean trim_on_free = FALSE;
+
 /**
  * PURPOSE: checks invariants for the Region.
  * INPUT PARAMETERS:
@@ -62,7 +83,30 @@ static void validate_region(Region *region){
     rsize_t sum = 0;
     Node *curr = NULL;
     Node *next = NULL;
-    
+    Span *span = NULL;
+    rsize_t prev_end = 0;
+
+    span = region->clean;
+    while(span != NULL){
+        assert(span->size > 0);
+        assert(span->start >= prev_end); //spans are sorted and don't overlap
+        assert(span->start + span->size <= region->size);
+        prev_end = span->start + span->size;
+        span = span->next;
+    }
+
+    //no block handed out to the user may sit on memory that is assumed to be zero
+    curr = region->top;
+    span = region->clean;
+    while(curr != NULL && span != NULL){
+        assert(curr->start + curr->size <= span->start || span->start + span->size <= curr->start);
+        if(curr->start + curr->size <= span->start + span->size){
+            curr = curr->next;
+        } else {
+            span = span->next;
+        }
+    }
+
     if(region->top != NULL){
         curr = region->top;
 
@@ -114,6 +158,213 @@ static void validate_r_list(){
 
 }
 
+/**
+ * PURPOSE: Returns the size of a page of memory, which is the unit madvise() works in.
+ */
+
+static size_t page_size(){
+    static size_t size = 0;
+
+    if(size == 0){
+        size = sysconf(_SC_PAGESIZE);
+    }
+
+    return size;
+}
+
+/**
+ * PURPOSE: Counts how many bytes of a region's buffer are currently resident in memory.
+ * INPUT PARAMETERS:
+ *    Region *region - the region to measure.
+ * OUTPUT PARAMETERS:
+ *    unsigned long - the number of resident bytes, rounded to whole pages. Returns 0 if it couldn't be measured.
+ */
+
+static unsigned long resident(Region *region){
+    size_t pages = ((size_t)region->size + page_size() - 1) / page_size();
+    unsigned char *vec = malloc(pages);
+    unsigned long count = 0;
+    size_t i;
+
+    if(vec != NULL && mincore(region->buffer, region->size, vec) == 0){
+        for(i = 0; i < pages; i++){
+            if(vec[i] & 1){
+                count++;
+            }
+        }
+    }
+    free(vec);
+
+    return count * page_size();
+}
+
+/**
+ * PURPOSE: Records that a span of a region's buffer is zero-filled. Merges it with any spans it touches or overlaps so the list stays sorted and disjoint.
+ * INPUT PARAMETERS:
+ *    Region *region - the region the span belongs to.
+ *    rsize_t start - start of the span in bytes into the buffer.
+ *    rsize_t size - size of the span.
+ */
+
+static void add_clean(Region *region, rsize_t start, rsize_t size){
+    rsize_t end = start + size;
+    Span *prev = NULL;
+    Span *curr = region->clean;
+    Span *next = NULL;
+    Span *span = NULL;
+
+    while(curr != NULL && curr->start + curr->size < start){
+        prev = curr;
+        curr = curr->next;
+    }
+
+    while(curr != NULL && curr->start <= end){
+        //absorb every span that touches the new one
+        if(curr->start < start){
+            start = curr->start;
+        }
+        if(curr->start + curr->size > end){
+            end = curr->start + curr->size;
+        }
+        next = curr->next;
+        free(curr);
+        curr = next;
+    }
+
+    span = malloc(sizeof(Span));
+    span->start = start;
+    span->size = end - start;
+    span->next = curr;
+
+    if(prev == NULL){
+        region->clean = span;
+    } else {
+        prev->next = span;
+    }
+}
+
+/**
+ * PURPOSE: Prepares a newly allocated block for the user. Zeroes only the parts of the block that aren't already known to be zero, then removes the block from the clean spans since the user will write to it.
+ * INPUT PARAMETERS:
+ *    Region *region - the region the block was allocated in.
+ *    rsize_t start - start of the block in bytes into the buffer.
+ *    rsize_t size - size of the block.
+ */
+
+static void claim_block(Region *region, rsize_t start, rsize_t size){
+    rsize_t end = start + size;
+    rsize_t pos = start; //everything in the block before pos is zero
+    rsize_t span_end;
+    Span *prev = NULL;
+    Span *curr = region->clean;
+    Span *next = NULL;
+    Span *tail = NULL;
+
+    while(curr != NULL && curr->start < end){
+        next = curr->next;
+        span_end = curr->start + curr->size;
+
+        if(span_end <= start){
+            //entirely before the block
+            prev = curr;
+        } else {
+            if(curr->start > pos){
+                memset((char *)region->buffer + pos, 0, curr->start - pos);
+            }
+            pos = span_end;
+
+            if(curr->start < start && span_end > end){
+                //block is in the middle of the span; split it in two
+                tail = malloc(sizeof(Span));
+                tail->start = end;
+                tail->size = span_end - end;
+                tail->next = next;
+                curr->size = start - curr->start;
+                curr->next = tail;
+                prev = tail;
+            } else if(curr->start < start){
+                curr->size = start - curr->start; //keep the front of the span
+                prev = curr;
+            } else if(span_end > end){
+                curr->start = end; //keep the back of the span
+                curr->size = span_end - end;
+                prev = curr;
+            } else {
+                //block covers the whole span
+                if(prev == NULL){
+                    region->clean = next;
+                } else {
+                    prev->next = next;
+                }
+                free(curr);
+            }
+        }
+        curr = next;
+    }
+
+    if(pos < end){
+        memset((char *)region->buffer + pos, 0, end - pos);
+    }
+}
+
+/**
+ * PURPOSE: Releases the whole pages inside a free gap of a region's buffer back to the OS and remembers them as zero-filled.
+ *          On Linux this is madvise(MADV_DONTNEED), which guarantees private anonymous pages read back as zero. MADV_FREE is not used because pages freed
+ *          that way may still hold their old contents. Other systems make no such promise for MADV_DONTNEED, so there the pages are replaced with a fresh anonymous mapping instead.
+ * INPUT PARAMETERS:
+ *    Region *region - the region the gap belongs to.
+ *    rsize_t start - start of the gap in bytes into the buffer.
+ *    rsize_t end - end of the gap in bytes into the buffer.
+ * OUTPUT PARAMETERS:
+ *    size_t - the number of bytes released. Pages that were already released and not used since are not counted.
+ */
+
+static size_t trim_gap(Region *region, rsize_t start, rsize_t end){
+    //rounded in size_t because rounding up near the end of the region may not fit in an rsize_t
+    size_t first = ((size_t)start + page_size() - 1) / page_size() * page_size();
+    size_t last = (size_t)end / page_size() * page_size();
+    size_t pos = first;
+    size_t dirty_start;
+    size_t dirty_end;
+    size_t out = 0;
+    Span *span = NULL;
+
+    //only pages holding memory that isn't already known to be zero are released, so nothing is released or counted twice
+    //the buffer is page aligned, so offsets into it line up with pages
+    while(pos < last){
+        span = region->clean;
+        while(span != NULL && span->start + span->size <= pos){
+            span = span->next;
+        }
+
+        if(span != NULL && span->start <= pos){
+            pos = span->start + span->size; //skip memory that is already zero
+        } else {
+            //dirty up to the next clean span; release every page it touches
+            dirty_start = pos / page_size() * page_size();
+            if(span != NULL && span->start < last){
+                dirty_end = ((size_t)span->start + page_size() - 1) / page_size() * page_size();
+            } else {
+                dirty_end = last;
+            }
+            if(dirty_end > last){
+                dirty_end = last;
+            }
+#ifdef __linux__
+            if(madvise((char *)region->buffer + dirty_start, dirty_end - dirty_start, MADV_DONTNEED) == 0){
+#else
+            if(mmap((char *)region->buffer + dirty_start, dirty_end - dirty_start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED){
+#endif
+                add_clean(region, dirty_start, dirty_end - dirty_start);
+                out = out + dirty_end - dirty_start;
+            }
+            pos = dirty_end;
+        }
+    }
+
+    return out;
+}
+
 /**
  * PURPOSE: Creates a memory region and allocates memory for it. Names the region. Saves the region into a list and sets the current region to the newly created region.
  *          Will also create a new list if a list of regions has not been created yet.
@@ -144,14 +395,19 @@ Boolean rinit(const char *name, rsize_t size) {
     if(success == TRUE){
         if (size <= 0 || strlen(name) < 1){
             success = FALSE;
-        } else if(size % BYTE_8 != 0){
-            region = malloc(sizeof(Region));
-            region->buffer = malloc( (size/BYTE_8)*BYTE_8 + BYTE_8 );
-            region->size = (size/BYTE_8)*BYTE_8 + BYTE_8;
         } else {
             region = malloc(sizeof(Region));
-            region->buffer = malloc(size);
-            region->size = size;
+            if(size % BYTE_8 != 0){
+                region->size = (size/BYTE_8)*BYTE_8 + BYTE_8;
+            } else {
+                region->size = size;
+            }
+            //mapped rather than malloc'd so the buffer is page aligned and starts out zero-filled without being touched
+            region->buffer = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(region->buffer == MAP_FAILED){
+                free(region);
+                success = FALSE;
+            }
         }
     }
 
@@ -171,6 +427,12 @@ Boolean rinit(const char *name, rsize_t size) {
         strcpy(region->name, name);
         region->length = 0;
         region->top = NULL; //List for stored data yet.
+        region->clean = NULL;
+        region->rss_before = 0;
+        region->rss_after = 0;
+        region->trimmed = FALSE;
+        region->released = 0;
+        add_clean(region, 0, region->size); //fresh anonymous memory is all zeroes
 
         if(region_list->top == NULL) {
             //empty list; add first region
@@ -184,7 +446,6 @@ Boolean rinit(const char *name, rsize_t size) {
             region_list->size = region_list->size + 1;
         }
 
-        memset(region->buffer, 0, region->size);
         current = region;
     }
 
@@ -279,8 +540,6 @@ void *ralloc(rsize_t block_size){
             out = new_node->block;
             region->length = region->length + 1;
 
-            validate_r_list();
-
         } else if (region->top->start >= new_size){
             //check buffer start point to first node's size because first node doesn't start at beginning of allocated memory
             new_node = malloc(sizeof(Node));
@@ -292,8 +551,6 @@ void *ralloc(rsize_t block_size){
             out = new_node->block;
             region->length = region->length + 1;
 
-            validate_r_list();
-
         } else {
             curr = region->top;
             while(found == FALSE && curr->next != NULL){
@@ -330,7 +587,7 @@ void *ralloc(rsize_t block_size){
     }
 
     if(out != NULL){
-        memset(new_node->block, 0, new_node->size);
+        claim_block(region, new_node->start, new_node->size);
     }
 
     validate_r_list();
@@ -368,6 +625,8 @@ rsize_t rsize(void *block_ptr){
 
 /**
  * PURPOSE: Removes the Node/block of memory in its allocated region. It also frees the Node (but not the allocated memory) so it can be used again.
+ *          If trimming on free is turned on (see rtrim_config()), the free gap the block leaves behind is released to the OS when it is at least the trim threshold.
+ *          Only the bytes released are recorded; measuring the resident size would mean scanning the whole region on every free.
  * INPUT PARAMETERS:
  *    void *block_ptr - a void pointer to the block that needs to be freed.
  * OUTPUT PARAMETERS:
@@ -378,6 +637,8 @@ Boolean rfree(void *block_ptr){
     Boolean out = TRUE;
     Node *curr = NULL;
     Node *prev = NULL;
+    rsize_t gap_start = 0;
+    rsize_t gap_end = 0;
     //void *ptr = NULL;
 
     validate_r_list();
@@ -399,9 +660,22 @@ Boolean rfree(void *block_ptr){
             } else {
                  prev->next = curr->next; //removes node from list
             }
+
+            if(prev != NULL){
+                gap_start = prev->start + prev->size;
+            }
+            if(curr->next != NULL){
+                gap_end = curr->next->start;
+            } else {
+                gap_end = current->size;
+            }
             
             free(curr);
             current->length = current->length - 1;
+
+            if(trim_on_free == TRUE && gap_end - gap_start >= trim_threshold){
+                current->released = current->released + trim_gap(current, gap_start, gap_end);
+            }
         }
         
     }
@@ -423,6 +697,8 @@ void rdestroy(const char * region_name){
     Region *curr_region = NULL;
     Node *curr = NULL;
     Node *next = NULL;
+    Span *span = NULL;
+    Span *next_span = NULL;
 
     validate_r_list();
 
@@ -444,6 +720,13 @@ void rdestroy(const char * region_name){
                 curr = next;
             } // free all nodes in region
 
+            span = curr_region->clean;
+            while(span != NULL){
+                next_span = span->next;
+                free(span);
+                span = next_span;
+            } // free all clean spans in region
+
             if(current == curr_region){
                 if(prev_region != NULL){
                     current = prev_region;
@@ -466,7 +749,7 @@ void rdestroy(const char * region_name){
             }
 
             free(curr_region->name);
-            free(curr_region->buffer);
+            munmap(curr_region->buffer, curr_region->size);
             free(curr_region);
             region_list->size = region_list->size - 1;
         }
@@ -475,7 +758,76 @@ void rdestroy(const char * region_name){
 }
 
 /**
- * PURPOSE: Prints data about all the memory regions: Name of the region, followed by the address of each block of memory within the region and its size. It also prints the percentage of space remaining within the region.
+ * PURPOSE: Sets the policy for returning the memory of large free gaps to the OS.
+ * INPUT PARAMETERS:
+ *    rsize_t threshold - free gaps smaller than this many bytes are never released. Only whole pages inside a gap are released.
+ *    Boolean on_free - if true, rfree() releases the gap it leaves behind right away. If false, gaps are only released by rtrim().
+ */
+
+void rtrim_config(rsize_t threshold, Boolean on_free){
+    trim_threshold = threshold;
+    trim_on_free = on_free;
+}
+
+/**
+ * PURPOSE: Returns the memory of every free gap in a region that is at least the trim threshold to the OS. Meant to be called periodically when trimming on free is turned off.
+ *          The resident size of the region before and after is saved and shown by rdump().
+ * INPUT PARAMETERS:
+ *    const char *region_name - The name of the region to trim.
+ * OUTPUT PARAMETERS:
+ *    Boolean - returns false if the region does not exist.
+ */
+
+Boolean rtrim(const char *region_name){
+    Boolean out = FALSE;
+    Region *region = NULL;
+    Node *curr = NULL;
+    rsize_t gap_start = 0;
+    rsize_t gap_end = 0;
+
+    validate_r_list();
+
+    if(region_list != NULL){
+        region = region_list->top;
+        while(region != NULL && strcmp(region_name, region->name) != 0){
+            region = region->next;
+        }
+    }
+
+    if(region != NULL){
+        out = TRUE;
+        region->rss_before = resident(region);
+
+        curr = region->top;
+        while(gap_start < region->size){
+            if(curr != NULL){
+                gap_end = curr->start;
+            } else {
+                gap_end = region->size;
+            }
+            if(gap_end - gap_start >= trim_threshold){
+                region->released = region->released + trim_gap(region, gap_start, gap_end);
+            }
+            if(curr != NULL){
+                gap_start = curr->start + curr->size;
+                curr = curr->next;
+            } else {
+                gap_start = region->size;
+            }
+        } //walk the gap in front of each node, then the gap at the end
+
+        region->rss_after = resident(region);
+        region->trimmed = TRUE;
+    }
+
+    validate_r_list();
+
+    return out;
+}
+
+/**
+ * PURPOSE: Prints data about all the memory regions: Name of the region, followed by the address of each block of memory within the region and its size. It also prints the percentage of space remaining within the region,
+ *          how much of the region is resident in memory, how much has been released to the OS, and the resident size before and after the last rtrim().
  *          It repeats this for each region in the region list.
  */
 
@@ -499,6 +851,11 @@ void rdump(){
                 curr = curr->next;
             }
             printf("Percentage remaining: %d\n", (100 - 100*curr_size/curr_reg->size));
+            printf("Resident: %lu bytes\n", resident(curr_reg));
+            printf("Released to OS (total over all trims): %lu bytes\n", curr_reg->released);
+            if(curr_reg->trimmed == TRUE){
+                printf("Last rtrim: %lu bytes resident before, %lu after\n", curr_reg->rss_before, curr_reg->rss_after);
+            }
             curr_size = 0;
             curr_reg = curr_reg->next;
         }